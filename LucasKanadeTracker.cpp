@@ -4,6 +4,7 @@
 
 #include "LucasKanadeTracker.h"
 #include <opencv2/highgui.hpp>
+#include <algorithm>
 
 void LucasKanadeTracker::track(const cv::Mat &image, cv::Rect2f &roi) {
     if (!initialized) {
@@ -15,76 +16,155 @@ void LucasKanadeTracker::track(const cv::Mat &image, cv::Rect2f &roi) {
 
     auto w = static_cast<int>(std::floor(parameters.windowSize / 2.0f));
 
-    // Compute the x and y derivatives for the whole image
-    auto derivatives = computeDerivatives(prevImage);
-
-    for (auto &feature : features) {
-        auto window = buildWindow(feature, w);
-
-        // Next feature if window is too small
-        if (window.size().width < 2 || window.size().height < 2) continue;
+    // Compute the x and y derivatives for the whole image, they are reused as previous derivatives next frame
+    auto currentDerivatives = computeDerivatives(currentImage);
+
+    // Keep only features which converged and survive the forward-backward check
+    auto trackedFeatures = std::vector<cv::Point2f>();
+    trackedFeatures.reserve(features.size());
+    auto displacementsX = std::vector<float>();
+    auto displacementsY = std::vector<float>();
+    for (const auto &feature : features) {
+        auto forward = feature;
+        if (!trackFeature(prevImage, currentImage, prevDerivatives, forward, w)) continue;
+
+        if (parameters.bUseForwardBackward) {
+            // Track back into the previous frame and compare with the original position
+            auto backward = forward;
+            if (!trackFeature(currentImage, prevImage, currentDerivatives, backward, w) ||
+                cv::norm(backward - feature) > parameters.maxForwardBackwardError) {
+                continue;
+            }
+        }
+        trackedFeatures.push_back(forward);
+        displacementsX.push_back(forward.x - feature.x);
+        displacementsY.push_back(forward.y - feature.y);
+    }
+    features = std::move(trackedFeatures);
+
+    // Search for replacements inside the roi only
+    if (static_cast<int>(features.size()) < nMinPoints) {
+        auto searchRoi = roi;
+        if (!features.empty() && !searchRoi.empty()) {
+            // Move the previous roi along with the surviving features, so a partial loss can refill the whole object
+            auto median = displacementsX.size() / 2;
+            std::nth_element(displacementsX.begin(), displacementsX.begin() + median, displacementsX.end());
+            std::nth_element(displacementsY.begin(), displacementsY.begin() + median, displacementsY.end());
+            searchRoi += cv::Point2f(displacementsX[median], displacementsY[median]);
+            searchRoi |= updateRoi();
+        }
+        reseed(currentImage, searchRoi, w);
+    }
 
-        // Cut out the window from the derivatives
-        auto derivativeXWindow = std::get<0>(derivatives)(window).clone();
-        auto derivativeYWindow = std::get<1>(derivatives)(window).clone();
-        // Cut out the window of the previous frame
-        auto prevWindow = prevImage(window).clone();
+    // Copy current to previous mat
+    currentImage.copyTo(prevImage);
+    prevDerivatives = currentDerivatives;
 
-        // Iteratively figure out new feature position
-        auto prevX = 0.0f;
-        auto prevY = 0.0f;
-        for (auto i = 0; i < parameters.nMaxIterations; ++i) {
-            // Build new window
-            window = buildWindow(feature, w);
+    if (!features.empty()) {
+        roi = updateRoi();
+    }
+}
 
-            if (window.size().width < 1 || window.size().height < 1) continue;
+bool LucasKanadeTracker::trackFeature(const cv::Mat &fromImage, const cv::Mat &toImage,
+                                      const std::tuple<cv::Mat, cv::Mat> &derivatives, cv::Point2f &feature,
+                                      int w) const {
+    auto window = buildWindow(feature, w);
+
+    // Lost if window is too small
+    if (window.size().width < 2 || window.size().height < 2) return false;
+
+    // Cut out the window from the derivatives
+    auto derivativeXWindow = std::get<0>(derivatives)(window).clone();
+    auto derivativeYWindow = std::get<1>(derivatives)(window).clone();
+    // Cut out the window of the frame to track from
+    auto fromWindow = fromImage(window).clone();
+
+    // Iteratively figure out new feature position
+    auto prevX = feature.x;
+    auto prevY = feature.y;
+    for (auto i = 0; i < parameters.nMaxIterations; ++i) {
+        // Build new window
+        window = buildWindow(feature, w);
+
+        // Lost if the feature left the image
+        if (window.size().width < 1 || window.size().height < 1) return false;
+
+        // Cut out the window of the frame to track to
+        auto toWindow = toImage(window).clone();
+
+        // Get time derivative
+        auto derivativeTWindow = cv::Mat();
+        cv::resize(toWindow, derivativeTWindow, fromWindow.size());
+        derivativeTWindow = cv::Mat(derivativeTWindow - fromWindow);
+
+        // Rearrange matrices
+        auto A1 = cv::Mat(derivativeXWindow.reshape(0, 1).t());
+        auto A2 = cv::Mat(derivativeYWindow.reshape(0, 1).t());
+        auto b = cv::Mat(-derivativeTWindow.reshape(0, 1).t());
+
+        if (parameters.bUseGauss) {
+            filter(A1, A2, b, derivativeXWindow.size().width);
+        }
 
-            // Cut out the window of the current frame
-            auto currWindow = currentImage(window).clone();
+        // Combine A1 and A2
+        auto A = cv::Mat();
+        cv::hconcat(A1, A2, A);
+
+        // Solve the over determined equation system
+        // All methods are identical
+//        auto v = cv::Mat();
+//        cv::solve(A, b, v, cv::DECOMP_SVD);
+        auto v = cv::Mat(A.inv(cv::DECOMP_SVD) * b);
+//        auto v = cv::Mat((A.t() * A).inv() * A.t() * b);
+
+        // Update the feature position
+        feature.x += v.at<float>(0);
+        feature.y += v.at<float>(1);
+
+        // Converged if the changes are too small and the feature is still inside the image
+        if (std::abs(prevX - feature.x) < parameters.iterationEps &&
+            std::abs(prevY - feature.y) < parameters.iterationEps) {
+            return cv::Rect2f(cv::Point2f(), cv::Size2f(toImage.size())).contains(feature);
+        }
+        prevX = feature.x;
+        prevY = feature.y;
+    }
 
-            // Get time derivative
-            auto derivativeTWindow = cv::Mat();
-            cv::resize(currWindow, derivativeTWindow, prevWindow.size());
-            derivativeTWindow = cv::Mat(derivativeTWindow - prevWindow);
+    // Iteration budget exhausted without converging
+    return false;
+}
 
-            // Rearrange matrices
-            auto A1 = cv::Mat(derivativeXWindow.reshape(0, 1).t());
-            auto A2 = cv::Mat(derivativeYWindow.reshape(0, 1).t());
-            auto b = cv::Mat(-derivativeTWindow.reshape(0, 1).t());
+void LucasKanadeTracker::reseed(const cv::Mat &image, const cv::Rect2f &roi, int padding) {
+    // Never exceed the initial count, evaluate divides by it
+    auto nMissing = nInitialPoints - static_cast<int>(features.size());
+    if (nMissing <= 0) return;
 
-            if (parameters.bUseGauss) {
-                filter(A1, A2, b, derivativeXWindow.size().width);
-            }
+    // Search the full frame for an empty roi like initialize does
+    auto region = cv::Rect(cv::Point(), image.size());
+    if (!roi.empty()) {
+        // Pad the roi so corners at its border are found as well, then clip it to the image
+        auto paddedRoi = cv::Rect(roi);
+        paddedRoi -= cv::Point(padding, padding);
+        paddedRoi += cv::Size(2 * padding, 2 * padding);
+        region &= paddedRoi;
+    }
+    if (region.width < 3 || region.height < 3) return;
 
-            // Combine A1 and A2
-            auto A = cv::Mat();
-            cv::hconcat(A1, A2, A);
-
-            // Solve the over determined equation system
-            // All methods are identical
-//            auto v = cv::Mat();
-//            cv::solve(A, b, v, cv::DECOMP_SVD);
-            auto v = cv::Mat(A.inv(cv::DECOMP_SVD) * b);
-//            auto v = cv::Mat((A.t() * A).inv() * A.t() * b);
-
-            // Update the feature position
-            feature.x += v.at<float>(0);
-            feature.y += v.at<float>(1);
-
-            // Stop the loop if the changes are too small
-            if (std::abs(prevX - feature.x) < parameters.iterationEps &&
-                std::abs(prevY - feature.y) < parameters.iterationEps) {
-                break;
-            }
-            prevX = feature.x;
-            prevY = feature.y;
-        }
+    // Keep the minimum distance to the surviving features
+    auto mask = cv::Mat(region.size(), CV_8UC1, cv::Scalar(255));
+    for (const auto &feature : features) {
+        cv::circle(mask, cv::Point(cv::Point2f(feature.x - region.x, feature.y - region.y)),
+                   static_cast<int>(std::ceil(parameters.minDistance)), cv::Scalar(0), -1);
     }
 
-    // Copy current to previous mat
-    currentImage.copyTo(prevImage);
+    // Corner response is only computed inside the region
+    auto newFeatures = std::vector<cv::Point2f>();
+    cv::goodFeaturesToTrack(image(region), newFeatures, nMissing, parameters.qualityLevel, parameters.minDistance,
+                            mask);
 
-    roi = updateRoi();
+    for (const auto &feature : newFeatures) {
+        features.emplace_back(feature.x + region.x, feature.y + region.y);
+    }
 }
 
 void LucasKanadeTracker::initialize(const cv::Mat &image, const cv::Rect2f &roi) {
@@ -93,6 +173,7 @@ void LucasKanadeTracker::initialize(const cv::Mat &image, const cv::Rect2f &roi)
     cv::cvtColor(image, gray, CV_BGR2GRAY);
     gray.convertTo(gray, CV_32F);
     gray.copyTo(prevImage);
+    prevDerivatives = computeDerivatives(prevImage);
 
     // Get new tracking points
     auto mask = cv::Mat(gray.size(), CV_8UC1, cv::Scalar(0));
@@ -108,6 +189,8 @@ void LucasKanadeTracker::initialize(const cv::Mat &image, const cv::Rect2f &roi)
 //        cv::cornerSubPix(gray, features, cv::Size(10, 10), cv::Size(-1, -1), cv::TermCriteria());
         initialized = true;
         nInitialPoints = static_cast<int>(features.size());
+        // Re-seed only below what the first detection could find
+        nMinPoints = std::min(parameters.nMinFeatures, nInitialPoints);
     }
 }
 
@@ -19,6 +19,9 @@ public:
         int nMaxIterations = 40;
         int windowSize = 21;
         float iterationEps = 0.05f;
+        bool bUseForwardBackward = true;
+        float maxForwardBackwardError = 2.0f;
+        int nMinFeatures = 15;
     };
 
     explicit LucasKanadeTracker(const Parameters &parameters) :
@@ -26,7 +29,9 @@ public:
             initialized(false),
             features(),
             prevImage(),
-            nInitialPoints(0) {
+            prevDerivatives(),
+            nInitialPoints(0),
+            nMinPoints(0) {
     }
 
     void track(const cv::Mat &image, cv::Rect2f &roi) override;
@@ -53,7 +58,9 @@ private:
     bool initialized;
     std::vector<cv::Point2f> features;
     cv::Mat prevImage;
+    std::tuple<cv::Mat, cv::Mat> prevDerivatives;
     int nInitialPoints;
+    int nMinPoints;
 
     void initialize(const cv::Mat &image, const cv::Rect2f &roi);
 
@@ -63,6 +70,11 @@ private:
 
     std::tuple<cv::Mat, cv::Mat> computeDerivatives(const cv::Mat &image) const;
 
+    bool trackFeature(const cv::Mat &fromImage, const cv::Mat &toImage,
+                      const std::tuple<cv::Mat, cv::Mat> &derivatives, cv::Point2f &feature, int w) const;
+
+    void reseed(const cv::Mat &image, const cv::Rect2f &roi, int padding);
+
     cv::Rect2f buildWindow(const cv::Point2f &feature, int w) const;
 
     void filter(cv::Mat &A1, cv::Mat &A2, cv::Mat &b, int i) const;
@@ -3,6 +3,7 @@
 //
 
 #include "MeanshiftTracker.h"
+#include <opencv2/core/utility.hpp>
 
 void MeanshiftTracker::track(const cv::Mat &image, cv::Rect2f &roi) {
     roiToBounds(roi, image.size());
@@ -11,11 +12,16 @@ void MeanshiftTracker::track(const cv::Mat &image, cv::Rect2f &roi) {
         initialize(image, roi);
     }
 
-    auto currBackBGR = getBackProject(image, targetHist);
+    // The fused variant never writes the back projection to memory
+    auto currBackBGR = cv::Mat();
+    if (!parameters.bFuseBackProject) {
+        currBackBGR = getBackProject(image, targetWeights, binLookup);
+    }
 
     for (auto i = 0; i < parameters.nMaxIterations; ++i) {
         // Calculate center of mass according to OpenCV doc
-        auto moments = cv::moments(currBackBGR(roi));
+        auto moments = parameters.bFuseBackProject ? getMoments(image, targetWeights, binLookup, cv::Rect(roi))
+                                                   : cv::moments(currBackBGR(roi));
         auto centroid = cv::Point2f(static_cast<float>(moments.m10 / moments.m00),
                                     static_cast<float>(moments.m01 / moments.m00));
 
@@ -37,34 +43,146 @@ void MeanshiftTracker::track(const cv::Mat &image, cv::Rect2f &roi) {
 
 void MeanshiftTracker::initialize(const cv::Mat &image, cv::Rect2f &roi) {
     auto win = image(roi).clone();
-    targetHist = getHistogram(win, parameters.nBins);
+    binLookup = getBinLookup(parameters.nBins);
+    targetHist = getHistogram(win, binLookup, parameters.nBins);
+    targetWeights = getWeights(targetHist);
     initialized = true;
 }
 
-cv::Mat MeanshiftTracker::getHistogram(const cv::Mat &image, int nBins) const {
+cv::Mat MeanshiftTracker::getHistogram(const cv::Mat &image, const std::array<int, 256> &lookup, int nBins) const {
+    CV_Assert(image.type() == CV_8UC3);
+
     int histSizes[] = {nBins, nBins, nBins};
 
-    float range[] = {0, 255};
-    const float *histRanges[] = {range, range, range};
+    auto area = cv::Rect(cv::Point(), image.size());
+    auto nTiles = getNumTiles(area);
+    auto nStripes = getNumStripes(nTiles);
+
+    // Every stripe counts into its own partial histogram
+    auto partials = std::vector<cv::Mat>(static_cast<std::size_t>(nStripes));
+    cv::parallel_for_(cv::Range(0, nStripes), [&](const cv::Range &range) {
+        for (auto s = range.start; s < range.end; ++s) {
+            auto partial = cv::Mat(3, histSizes, CV_32S, cv::Scalar(0));
+            auto counts = partial.ptr<int>();
+            auto stripe = getStripe(s, nStripes, nTiles);
+            for (auto t = stripe.start; t < stripe.end; ++t) {
+                auto tile = getTile(area, t);
+                for (auto y = tile.y; y < tile.y + tile.height; ++y) {
+                    auto pixel = image.ptr<cv::Vec3b>(y) + tile.x;
+                    for (auto x = 0; x < tile.width; ++x, ++pixel) {
+                        auto bin = getBin(lookup, *pixel, nBins);
+                        if (bin >= 0) {
+                            ++counts[bin];
+                        }
+                    }
+                }
+            }
+            partials[s] = partial;
+        }
+    });
 
-    int channels[] = {0, 1, 2};
-    auto hist = cv::Mat();
-    cv::calcHist(&image, 1, channels, cv::Mat(), hist, 3, histSizes, histRanges);
+    // Merge the partial histograms
+    auto hist = cv::Mat(3, histSizes, CV_32F, cv::Scalar(0));
+    for (const auto &partial : partials) {
+        cv::add(hist, partial, hist, cv::noArray(), CV_32F);
+    }
     cv::normalize(hist, hist, 0, 255, cv::NORM_MINMAX, -1, cv::Mat());
     return hist;
 }
 
-cv::Mat MeanshiftTracker::getBackProject(const cv::Mat &image, const cv::Mat &hist) const {
-    float range[] = {0, 255};
-    const float *histRanges[] = {range, range, range};
+cv::Mat MeanshiftTracker::getWeights(const cv::Mat &hist) const {
+    // Back projecting an 8 bit image rounds the histogram values to 8 bit as well
+    auto weights = cv::Mat();
+    hist.convertTo(weights, CV_8U);
+    weights.convertTo(weights, CV_32F);
+    return weights;
+}
 
-    int channels[] = {0, 1, 2};
-    auto back = cv::Mat();
-    cv::calcBackProject(&image, 1, channels, hist, back, histRanges);
-    back.convertTo(back, CV_32F);
+cv::Mat MeanshiftTracker::getBackProject(const cv::Mat &image, const cv::Mat &weights,
+                                         const std::array<int, 256> &lookup) const {
+    CV_Assert(image.type() == CV_8UC3);
+
+    auto nBins = weights.size[0];
+    auto area = cv::Rect(cv::Point(), image.size());
+    auto weightValues = weights.ptr<float>();
+
+    // Tiles write disjoint parts of the back projection
+    auto back = cv::Mat(image.size(), CV_32F);
+    cv::parallel_for_(cv::Range(0, getNumTiles(area)), [&](const cv::Range &range) {
+        for (auto t = range.start; t < range.end; ++t) {
+            auto tile = getTile(area, t);
+            for (auto y = tile.y; y < tile.y + tile.height; ++y) {
+                auto pixel = image.ptr<cv::Vec3b>(y) + tile.x;
+                auto value = back.ptr<float>(y) + tile.x;
+                for (auto x = 0; x < tile.width; ++x, ++pixel, ++value) {
+                    auto bin = getBin(lookup, *pixel, nBins);
+                    *value = (bin >= 0) ? weightValues[bin] : 0.0f;
+                }
+            }
+        }
+    });
     return back;
 }
 
+cv::Moments MeanshiftTracker::getMoments(const cv::Mat &image, const cv::Mat &weights,
+                                         const std::array<int, 256> &lookup, const cv::Rect &window) const {
+    CV_Assert(image.type() == CV_8UC3);
+
+    auto nBins = weights.size[0];
+    auto area = window & cv::Rect(cv::Point(), image.size());
+    auto nTiles = getNumTiles(area);
+    auto nStripes = getNumStripes(nTiles);
+    auto weightValues = weights.ptr<float>();
+
+    // Back project and sum up m00, m10 and m01 per stripe, relative to the window like cv::moments
+    auto partials = std::vector<cv::Vec3d>(static_cast<std::size_t>(nStripes));
+    cv::parallel_for_(cv::Range(0, nStripes), [&](const cv::Range &range) {
+        for (auto s = range.start; s < range.end; ++s) {
+            auto sums = cv::Vec3d();
+            auto stripe = getStripe(s, nStripes, nTiles);
+            for (auto t = stripe.start; t < stripe.end; ++t) {
+                auto tile = getTile(area, t);
+                for (auto y = tile.y; y < tile.y + tile.height; ++y) {
+                    auto pixel = image.ptr<cv::Vec3b>(y) + tile.x;
+                    auto rowSum = 0.0;
+                    auto rowSumX = 0.0;
+                    for (auto x = tile.x; x < tile.x + tile.width; ++x, ++pixel) {
+                        auto bin = getBin(lookup, *pixel, nBins);
+                        if (bin >= 0) {
+                            rowSum += weightValues[bin];
+                            rowSumX += weightValues[bin] * (x - window.x);
+                        }
+                    }
+                    sums[0] += rowSum;
+                    sums[1] += rowSumX;
+                    sums[2] += rowSum * (y - window.y);
+                }
+            }
+            partials[s] = sums;
+        }
+    });
+
+    // Merge the partial sums
+    auto moments = cv::Moments();
+    for (const auto &sums : partials) {
+        moments.m00 += sums[0];
+        moments.m10 += sums[1];
+        moments.m01 += sums[2];
+    }
+    return moments;
+}
+
+std::array<int, 256> MeanshiftTracker::getBinLookup(int nBins) const {
+    // Same binning as cv::calcHist with the range [0, 255), values outside are marked with -1
+    auto lookup = std::array<int, 256>();
+    auto scale = nBins / 255.0;
+    for (auto v = 0; v < 256; ++v) {
+        auto bin = cvFloor(v * scale);
+        lookup[v] = (bin < nBins) ? bin : -1;
+    }
+    return lookup;
+}
+
 float MeanshiftTracker::evaluate(const cv::Rect2f &roi, const cv::Rect2f &groundTruthRoi) const {
     // Intersection over union
     return (roi & groundTruthRoi).area() / (roi | groundTruthRoi).area();
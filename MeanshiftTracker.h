@@ -5,6 +5,7 @@
 #ifndef TRACKING_MEANSHIFTTRACKER_H
 #define TRACKING_MEANSHIFTTRACKER_H
 
+#include <array>
 #include <opencv2/tracking.hpp>
 #include "Tracker.h"
 
@@ -13,12 +14,17 @@ public:
     struct Parameters {
         int nMaxIterations = 200;
         int nBins = 32;
+        int tileSize = 64;
+        bool bFuseBackProject = true;
     };
 
     explicit MeanshiftTracker(const Parameters &parameters) :
             parameters(parameters),
             initialized(false),
-            targetHist() {
+            targetHist(),
+            targetWeights(),
+            binLookup() {
+        CV_Assert(parameters.tileSize > 0);
     }
 
     void track(const cv::Mat &image, cv::Rect2f &roi) override;
@@ -37,12 +43,53 @@ private:
     Parameters parameters;
     bool initialized;
     cv::Mat targetHist;
+    cv::Mat targetWeights;
+    std::array<int, 256> binLookup;
 
     void initialize(const cv::Mat &image, cv::Rect2f &roi);
 
-    cv::Mat getHistogram(const cv::Mat &image, int nBins) const;
+    cv::Mat getHistogram(const cv::Mat &image, const std::array<int, 256> &lookup, int nBins) const;
 
-    cv::Mat getBackProject(const cv::Mat &image, const cv::Mat &hist) const;
+    cv::Mat getWeights(const cv::Mat &hist) const;
+
+    cv::Mat getBackProject(const cv::Mat &image, const cv::Mat &weights,
+                           const std::array<int, 256> &lookup) const;
+
+    cv::Moments getMoments(const cv::Mat &image, const cv::Mat &weights, const std::array<int, 256> &lookup,
+                           const cv::Rect &window) const;
+
+    std::array<int, 256> getBinLookup(int nBins) const;
+
+    int getBin(const std::array<int, 256> &lookup, const cv::Vec3b &pixel, int nBins) const {
+        auto b0 = lookup[pixel[0]];
+        auto b1 = lookup[pixel[1]];
+        auto b2 = lookup[pixel[2]];
+        // Out of range channels are -1, so the bitwise or is negative if any channel is out of range
+        return ((b0 | b1 | b2) >= 0) ? (b0 * nBins + b1) * nBins + b2 : -1;
+    }
+
+    int getNumTiles(const cv::Rect &area) const {
+        auto nTilesX = (area.width + parameters.tileSize - 1) / parameters.tileSize;
+        auto nTilesY = (area.height + parameters.tileSize - 1) / parameters.tileSize;
+        return nTilesX * nTilesY;
+    }
+
+    cv::Rect getTile(const cv::Rect &area, int tile) const {
+        // Split the area into cache sized tiles, row by row
+        auto nTilesX = (area.width + parameters.tileSize - 1) / parameters.tileSize;
+        auto x = area.x + (tile % nTilesX) * parameters.tileSize;
+        auto y = area.y + (tile / nTilesX) * parameters.tileSize;
+        return cv::Rect(x, y, parameters.tileSize, parameters.tileSize) & area;
+    }
+
+    int getNumStripes(int nTiles) const {
+        return std::max(1, std::min(cv::getNumThreads(), nTiles));
+    }
+
+    cv::Range getStripe(int stripe, int nStripes, int nTiles) const {
+        // Contiguous range of tiles handled by one stripe
+        return cv::Range(nTiles * stripe / nStripes, nTiles * (stripe + 1) / nStripes);
+    }
 
     void roiToBounds(cv::Rect2f &roi, const cv::Size size) const {
         // Ensure roi is in image bounds